@@ -24,9 +24,55 @@
 // https://refactoring.guru/design-patterns/strategy
 
 #include <memory>
+#include <memory_resource>
 #include <string>
 #include <iostream>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <random>
+#include <shared_mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// The sorting-network strategy uses SSE4.1/AVX2 kernels on x86 and picks one at runtime.
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define STRATEGY_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only emit SIMD instructions in functions that are compiled for them, MSVC always does.
+// The kernels are built from small helpers that must be inlined to keep the data in registers.
+// The benchmark's replacement operator new/delete must not be inlined, or GCC reports their malloc/free as mismatched.
+#if defined(__GNUC__)
+#define STRATEGY_TARGET(isa) __attribute__((target(isa)))
+#define STRATEGY_FORCE_INLINE inline __attribute__((always_inline))
+#define STRATEGY_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define STRATEGY_TARGET(isa)
+#define STRATEGY_FORCE_INLINE __forceinline
+#define STRATEGY_NOINLINE __declspec(noinline)
+#else
+#define STRATEGY_TARGET(isa)
+#define STRATEGY_FORCE_INLINE inline
+#define STRATEGY_NOINLINE
+#endif
 
 // Provides read-only access to an existing string (a C-style string literal, a std::string, or a char array) 
 // without making a copy.
@@ -38,9 +84,109 @@ class Strategy
 {
     public:
         virtual ~Strategy() = default;
-        virtual std::string doAlgorithm(std::string_view data) const = 0;
+
+        // Sorts the characters in [first, last) in place. This is the one operation every concrete strategy has to
+        // implement; resultLength and doAlgorithmBatch below have defaults that strategies may override.
+        // Note: doAlgorithm used to be the pure virtual operation. It is now a set of non-virtual wrappers around
+        // this one, so a strategy written against the old interface, which overrides doAlgorithm, no longer compiles:
+        // it stays abstract until it implements doAlgorithmInPlace instead.
+        virtual void doAlgorithmInPlace(char* first, char* last) const = 0;
+
+        // How much of the rearranged data is the result. Most strategies return everything they sorted,
+        // but e.g. a top-k strategy only leaves its k characters at the front of the range.
+        virtual std::size_t resultLength(std::size_t input_length) const
+        {
+            return input_length;
+        }
+
+        // Returns a sorted copy of the data.
+        std::string doAlgorithm(std::string_view data) const
+        {
+            std::string result(data);
+            doAlgorithmInPlace(result.data(), result.data() + result.size());
+            result.resize(resultLength(data.size()));
+
+            return result;
+        }
+
+        // Writes the sorted data into a caller-supplied buffer. The buffer keeps its capacity between calls,
+        // so a warm loop that reuses the same buffer does not allocate at all.
+        void doAlgorithm(std::string_view data, std::string& result) const
+        {
+            result.assign(data.data(), data.size());
+            doAlgorithmInPlace(result.data(), result.data() + result.size());
+            result.resize(resultLength(data.size()));
+        }
+
+        // Returns the sorted data in a string allocated from the given memory resource. With a per-request
+        // std::pmr::monotonic_buffer_resource, thousands of results cost a few bump allocations and are all
+        // released at once when the arena goes away. The results must not outlive the resource.
+        std::pmr::string doAlgorithm(std::string_view data, std::pmr::memory_resource* resource) const
+        {
+            std::pmr::string result(data, resource);
+            doAlgorithmInPlace(result.data(), result.data() + result.size());
+            result.resize(resultLength(data.size()));
+
+            return result;
+        }
+
+        // Sorts every string of a packed batch in place: string i is [blob + offsets[i], blob + offsets[i + 1]).
+        // As with doAlgorithmInPlace, the result of every string is the first resultLength() characters of its range.
+        // The whole batch costs one virtual call; strategies can override it so their kernel is inlined into the loop.
+        virtual void doAlgorithmBatch(char* blob, const std::size_t* offsets, std::size_t count) const
+        {
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                doAlgorithmInPlace(blob + offsets[i], blob + offsets[i + 1]);
+            }
+        }
+};
+
+// Many small strings packed into one buffer, so that a batch of them costs a couple of allocations
+// instead of one per string. String i is blob[offsets[i], offsets[i + 1]).
+struct PackedStrings
+{
+    std::string blob;
+    std::vector<std::size_t> offsets{ 0 };
+
+    void push_back(std::string_view text)
+    {
+        blob.append(text.data(), text.size());
+        offsets.push_back(blob.size());
+    }
+
+    std::size_t size() const
+    {
+        return offsets.size() - 1;
+    }
+
+    std::string_view operator[](std::size_t i) const
+    {
+        return std::string_view(blob).substr(offsets[i], offsets[i + 1] - offsets[i]);
+    }
 };
 
+// Runs fn(0) .. fn(threads - 1) on separate threads and waits for all of them to finish.
+// The calling thread takes the first slice itself, so one thread means no thread is spawned at all.
+template <typename Fn>
+void runInParallel(unsigned threads, Fn fn)
+{
+    std::vector<std::thread> workers;
+    workers.reserve(threads > 0 ? threads - 1 : 0);
+
+    for (unsigned t = 1; t < threads; ++t)
+    {
+        workers.emplace_back(fn, t);
+    }
+
+    fn(0u);
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+}
+
 // The Context defines the interface of interest to clients.
 class Context
 {
@@ -65,7 +211,7 @@ class Context
 
         // The Context delegates some work to the Strategy object instead of
         // implementing multiple versions of the algorithm on its own.
-        void doSomeBusinessLogic(std::string text_to_sort) const
+        void doSomeBusinessLogic(std::string_view text_to_sort) const
         {
             // The context calls the execution method on the linked strategy object each time it needs to run the algorithm. 
             // The context does not know what type of strategy it works with or how the algorithm is executed.
@@ -80,6 +226,65 @@ class Context
                 std::cout << "Context: Strategy isn't set\n";
             }
         }
+
+        // Quiet variants for hot loops. They neither copy the input nor print, and they only allocate
+        // while the caller's buffer is still growing. Without a strategy the data is left unsorted.
+        void doSomeBusinessLogic(std::string_view text_to_sort, std::string& result) const
+        {
+            if (strategy_)
+            {
+                strategy_->doAlgorithm(text_to_sort, result);
+            }
+            else
+            {
+                result.assign(text_to_sort.data(), text_to_sort.size());
+            }
+        }
+
+        void doSomeBusinessLogicInPlace(std::string& text_to_sort) const
+        {
+            if (strategy_)
+            {
+                strategy_->doAlgorithmInPlace(text_to_sort.data(), text_to_sort.data() + text_to_sort.size());
+                text_to_sort.resize(strategy_->resultLength(text_to_sort.size()));
+            }
+        }
+
+        // Allocates the result from the caller's memory resource, e.g. a per-request arena.
+        std::pmr::string doSomeBusinessLogic(std::string_view text_to_sort, std::pmr::memory_resource* resource) const
+        {
+            if (strategy_)
+            {
+                return strategy_->doAlgorithm(text_to_sort, resource);
+            }
+
+            return std::pmr::string(text_to_sort, resource);
+        }
+
+        // Sorts every string of the batch in place with a single call. The batch is split into
+        // contiguous slices, one per thread, and every slice costs one virtual call.
+        void doSomeBusinessLogicBatch(PackedStrings& batch, unsigned threads = std::thread::hardware_concurrency()) const
+        {
+            // Starting a thread only pays off if it gets a decent number of strings to sort.
+            constexpr std::size_t kStringsPerThread = 4096;
+
+            const std::size_t count = batch.size();
+
+            if (!strategy_ || count == 0)
+            {
+                return;
+            }
+
+            threads = static_cast<unsigned>(std::max<std::size_t>(1, std::min<std::size_t>(threads, count / kStringsPerThread)));
+
+            runInParallel(threads, [&](unsigned t)
+            {
+                const std::size_t first = count * t / threads;
+                const std::size_t last = count * (t + 1) / threads;
+
+                strategy_->doAlgorithmBatch(batch.blob.data(), batch.offsets.data() + first, last - first);
+            });
+        }
 };
 
 // Concrete Strategies implement different variations of an algorithm 
@@ -88,52 +293,1855 @@ class Context
 class ConcreteStrategyA : public Strategy
 {
     public:
-        std::string doAlgorithm(std::string_view data) const override
+        void doAlgorithmInPlace(char* first, char* last) const override
         {
-            std::string result(data);
-            std::sort(std::begin(result), std::end(result), std::less<>());
+            std::sort(first, last, std::less<>());
+        }
 
-            return result;
+        void doAlgorithmBatch(char* blob, const std::size_t* offsets, std::size_t count) const override
+        {
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                std::sort(blob + offsets[i], blob + offsets[i + 1], std::less<>());
+            }
         }
 };
 
 class ConcreteStrategyB : public Strategy
 {
-    std::string doAlgorithm(std::string_view data) const override
+    void doAlgorithmInPlace(char* first, char* last) const override
     {
-        std::string result(data);
-        std::sort(std::begin(result), std::end(result), std::greater<>());
+        std::sort(first, last, std::greater<>());
+    }
 
-        return result;
+    void doAlgorithmBatch(char* blob, const std::size_t* offsets, std::size_t count) const override
+    {
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            std::sort(blob + offsets[i], blob + offsets[i + 1], std::greater<>());
+        }
     }
 };
 
-// The client code picks a concrete strategy and passes it to the context. 
-// The client should be aware of the differences between strategies in order to make the right choice.
-void clientCode()
+// When the algorithm is known at compile time, the strategy can also be a template parameter (a policy)
+// instead of an object behind a pointer. A strategy policy is any type with a static sort(first, last).
+struct AscendingOrder
 {
-    // std::string text_to_sort("haegicbjdf");
-    std::string text_to_sort{"haegicbjdf"};
-    //std::string_view text_to_sort{"haegicbjdf"};
+    static void sort(char* first, char* last)
+    {
+        std::sort(first, last, std::less<>());
+    }
+};
 
-    // The Client creates a specific strategy object and passes it to the context. 
-    Context context(std::make_unique<ConcreteStrategyA>());
+struct DescendingOrder
+{
+    static void sort(char* first, char* last)
+    {
+        std::sort(first, last, std::greater<>());
+    }
+};
 
-    std::cout << "Client: Strategy is set to sort in ascending order.\n";
-    context.doSomeBusinessLogic(text_to_sort);
+// The compile-time counterpart of Context. The strategy cannot be swapped at runtime, but there is
+// no pointer to follow and no virtual call, so for tiny inputs on hot paths the compiler can inline
+// the whole kernel into the caller. Use Context when the strategy has to change at runtime.
+template <typename StrategyPolicy>
+class StaticContext
+{
+    public:
+        void doSomeBusinessLogic(std::string_view text_to_sort) const
+        {
+            std::cout << "StaticContext: Sorting data using the strategy chosen at compile time\n";
 
-    std::cout << "\n";
+            std::string result(text_to_sort);
+            StrategyPolicy::sort(result.data(), result.data() + result.size());
+            std::cout << result << "\n";
+        }
 
-    // The context exposes a setter which lets the Client replace 
-    // the strategy object associated with the context at runtime.
-    context.set_strategy(std::make_unique<ConcreteStrategyB>());
+        void doSomeBusinessLogic(std::string_view text_to_sort, std::string& result) const
+        {
+            result.assign(text_to_sort.data(), text_to_sort.size());
+            StrategyPolicy::sort(result.data(), result.data() + result.size());
+        }
 
-    std::cout << "Client: Strategy is set to sort in descending order.\n";
-    context.doSomeBusinessLogic(text_to_sort);
-}
+        void doSomeBusinessLogicInPlace(std::string& text_to_sort) const
+        {
+            StrategyPolicy::sort(text_to_sort.data(), text_to_sort.data() + text_to_sort.size());
+        }
+};
+
+// A multi-threaded strategy for very large inputs. It sorts in ascending order, just like ConcreteStrategyA.
+// Since the keys are single characters, the parallel sort is a one-pass radix (counting) sort:
+// every thread counts the characters of its own chunk, the counts are turned into output offsets,
+// and every thread then writes its own share of each character run. Below the threshold the
+// cost of the histograms and of starting threads outweighs the gain, so the strategy falls back to std::sort.
+class ParallelStrategy : public Strategy
+{
+    private:
+        unsigned threads_;
+        std::size_t sequential_threshold_;
+
+    public:
+        explicit ParallelStrategy(unsigned threads = std::thread::hardware_concurrency(), std::size_t sequential_threshold = 1 << 16)
+            : threads_(std::max(1u, threads)), sequential_threshold_(sequential_threshold) { }
+
+        void doAlgorithmInPlace(char* first, char* last) const override
+        {
+            const std::size_t size = static_cast<std::size_t>(last - first);
+
+            if (size == 0 || size < sequential_threshold_)
+            {
+                std::sort(first, last, std::less<>());
+                return;
+            }
+
+            // Every thread should get at least a threshold-sized chunk, otherwise it is not worth starting it.
+            const std::size_t chunks = size / std::max<std::size_t>(1, sequential_threshold_);
+            const unsigned threads = static_cast<unsigned>(std::max<std::size_t>(1, std::min<std::size_t>(threads_, chunks)));
+
+            const std::size_t chunk = (size + threads - 1) / threads;
+            std::vector<std::array<std::size_t, UCHAR_MAX + 1>> counts(threads);
+
+            // Phase 1: histogram of every chunk.
+            runInParallel(threads, [&](unsigned t)
+            {
+                std::array<std::size_t, UCHAR_MAX + 1>& count = counts[t];
+                count.fill(0);
+
+                const std::size_t begin = std::min(size, t * chunk);
+                const std::size_t end = std::min(size, begin + chunk);
+
+                for (std::size_t i = begin; i < end; ++i)
+                {
+                    ++count[static_cast<unsigned char>(first[i])];
+                }
+            });
+
+            // Phase 2: turn the counts into write offsets. Characters are visited in the order
+            // std::less<char> sorts them, so the result matches the sequential strategy exactly.
+            std::vector<std::array<std::size_t, UCHAR_MAX + 1>> offsets(threads);
+            std::size_t offset = 0;
+
+            for (int c = CHAR_MIN; c <= CHAR_MAX; ++c)
+            {
+                const unsigned char byte = static_cast<unsigned char>(c);
+
+                for (unsigned t = 0; t < threads; ++t)
+                {
+                    offsets[t][byte] = offset;
+                    offset += counts[t][byte];
+                }
+            }
+
+            // Phase 3: every thread writes its share of every character run. The input was fully
+            // consumed in phase 1, so the output can overwrite it in place.
+            runInParallel(threads, [&](unsigned t)
+            {
+                for (int c = CHAR_MIN; c <= CHAR_MAX; ++c)
+                {
+                    const unsigned char byte = static_cast<unsigned char>(c);
+                    std::fill_n(first + offsets[t][byte], counts[t][byte], static_cast<char>(c));
+                }
+            });
+        }
+};
+
+// A strategy for short inputs. std::sort spends most of its time on mispredicted branches when it sorts
+// a handful of characters, so inputs of up to 64 characters are instead padded to 64 and pushed through
+// a fixed bitonic sorting network, which has no data-dependent branches at all. Each of the network's
+// 21 stages compares every character with the one at index i ^ j and keeps either the smaller or the larger.
+// The stages run on SIMD registers (AVX2 or SSE4.1, picked once at runtime). Without either, and for
+// very short or longer inputs, it falls back to std::sort. It sorts in ascending order, just like ConcreteStrategyA.
+class SortingNetworkStrategy : public Strategy
+{
+    private:
+        static constexpr std::size_t kSize = 64;
+        static constexpr std::size_t kStages = 21;
+
+        // Below this size insertion sort (inside std::sort) is still faster than the whole network.
+        static constexpr std::size_t kMinSize = 10;
+
+        using Kernel = void (*)(char* values);
+
+        // Everything the kernels need to know about the network, computed once.
+        struct Network
+        {
+            // Stage s compares elements i and i ^ j[s].
+            std::array<std::size_t, kStages> j;
+            std::array<std::size_t, kStages> log_j;
+
+            // Per stage and element: 0xFF where the element keeps the smaller of the pair, 0 where it keeps the larger.
+            alignas(32) unsigned char keep_min[kStages][kSize];
+
+            // Byte shuffles that move every element's partner into its place, for j = 1, 2, 4 and 8
+            // (the partners of larger j live in another 128-bit lane or register).
+            alignas(32) unsigned char partner[4][32];
+
+            Network()
+            {
+                std::size_t stage = 0;
+
+                for (std::size_t block = 2; block <= kSize; block *= 2)
+                {
+                    for (std::size_t distance = block / 2; distance > 0; distance /= 2, ++stage)
+                    {
+                        j[stage] = distance;
+                        log_j[stage] = 0;
+
+                        while ((std::size_t{ 1 } << log_j[stage]) < distance)
+                        {
+                            ++log_j[stage];
+                        }
+
+                        for (std::size_t i = 0; i < kSize; ++i)
+                        {
+                            const bool ascending = (i & block) == 0;
+                            const bool lower = (i & distance) == 0;
+                            keep_min[stage][i] = (ascending == lower) ? 0xFF : 0x00;
+                        }
+                    }
+                }
+
+                for (std::size_t log = 0; log < 4; ++log)
+                {
+                    for (std::size_t i = 0; i < 32; ++i)
+                    {
+                        partner[log][i] = static_cast<unsigned char>((i % 16) ^ (std::size_t{ 1 } << log));
+                    }
+                }
+            }
+        };
+
+        static const Network& network()
+        {
+            static const Network instance;
+            return instance;
+        }
+
+#if STRATEGY_X86
+        // One merge step of the network: the stages with distances J, J / 2, ..., 1. The distance is a template
+        // parameter, so the whole network unrolls into straight-line code with every register known at compile time.
+        template <std::size_t J>
+        STRATEGY_TARGET("sse4.1")
+        static STRATEGY_FORCE_INLINE void mergeSse41(__m128i (&v)[4], const Network& net, std::size_t& stage)
+        {
+            if constexpr (J > 0)
+            {
+                __m128i partner[4];
+
+                for (std::size_t q = 0; q < 4; ++q)
+                {
+                    if constexpr (J < 16)
+                    {
+                        partner[q] = _mm_shuffle_epi8(v[q], _mm_load_si128(reinterpret_cast<const __m128i*>(net.partner[net.log_j[stage]])));
+                    }
+                    else
+                    {
+                        partner[q] = v[q ^ (J / 16)];
+                    }
+                }
+
+                for (std::size_t q = 0; q < 4; ++q)
+                {
+                    const __m128i keep_min = _mm_load_si128(reinterpret_cast<const __m128i*>(net.keep_min[stage] + 16 * q));
+                    v[q] = _mm_blendv_epi8(_mm_max_epi8(v[q], partner[q]), _mm_min_epi8(v[q], partner[q]), keep_min);
+                }
+
+                mergeSse41<J / 2>(v, net, ++stage);
+            }
+        }
+
+        STRATEGY_TARGET("sse4.1")
+        static void sortSse41(char* values)
+        {
+            const Network& net = network();
+            std::size_t stage = 0;
+            __m128i v[4];
+
+            for (std::size_t q = 0; q < 4; ++q)
+            {
+                v[q] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + 16 * q));
+            }
+
+            mergeSse41<1>(v, net, stage);
+            mergeSse41<2>(v, net, stage);
+            mergeSse41<4>(v, net, stage);
+            mergeSse41<8>(v, net, stage);
+            mergeSse41<16>(v, net, stage);
+            mergeSse41<32>(v, net, stage);
+
+            for (std::size_t q = 0; q < 4; ++q)
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(values + 16 * q), v[q]);
+            }
+        }
+
+        template <std::size_t J>
+        STRATEGY_TARGET("avx2")
+        static STRATEGY_FORCE_INLINE void mergeAvx2(__m256i (&v)[2], const Network& net, std::size_t& stage)
+        {
+            if constexpr (J > 0)
+            {
+                __m256i partner[2];
+
+                for (std::size_t q = 0; q < 2; ++q)
+                {
+                    if constexpr (J < 16)
+                    {
+                        partner[q] = _mm256_shuffle_epi8(v[q], _mm256_load_si256(reinterpret_cast<const __m256i*>(net.partner[net.log_j[stage]])));
+                    }
+                    else if constexpr (J == 16)
+                    {
+                        partner[q] = _mm256_permute2x128_si256(v[q], v[q], 0x01);
+                    }
+                    else
+                    {
+                        partner[q] = v[q ^ 1];
+                    }
+                }
+
+                for (std::size_t q = 0; q < 2; ++q)
+                {
+                    const __m256i keep_min = _mm256_load_si256(reinterpret_cast<const __m256i*>(net.keep_min[stage] + 32 * q));
+                    v[q] = _mm256_blendv_epi8(_mm256_max_epi8(v[q], partner[q]), _mm256_min_epi8(v[q], partner[q]), keep_min);
+                }
+
+                mergeAvx2<J / 2>(v, net, ++stage);
+            }
+        }
+
+        STRATEGY_TARGET("avx2")
+        static void sortAvx2(char* values)
+        {
+            const Network& net = network();
+            std::size_t stage = 0;
+            __m256i v[2];
+
+            for (std::size_t q = 0; q < 2; ++q)
+            {
+                v[q] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + 32 * q));
+            }
+
+            mergeAvx2<1>(v, net, stage);
+            mergeAvx2<2>(v, net, stage);
+            mergeAvx2<4>(v, net, stage);
+            mergeAvx2<8>(v, net, stage);
+            mergeAvx2<16>(v, net, stage);
+            mergeAvx2<32>(v, net, stage);
+
+            for (std::size_t q = 0; q < 2; ++q)
+            {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(values + 32 * q), v[q]);
+            }
+        }
+#endif
+
+        // The SIMD kernels compare signed bytes, so they are only used where char is signed.
+        // Without them there is no kernel: a scalar network is slower than std::sort.
+        static Kernel selectKernel()
+        {
+#if STRATEGY_X86
+            if (CHAR_MIN < 0)
+            {
+#if defined(_MSC_VER)
+                int info[4];
+                __cpuid(info, 0);
+                const int max_leaf = info[0];
+
+                __cpuid(info, 1);
+                const bool sse41 = (info[2] & (1 << 19)) != 0;
+                const bool os_saves_avx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 0x6) == 0x6;
+                bool avx2 = false;
+
+                if (max_leaf >= 7 && os_saves_avx)
+                {
+                    __cpuidex(info, 7, 0);
+                    avx2 = (info[1] & (1 << 5)) != 0;
+                }
+#else
+                const bool sse41 = __builtin_cpu_supports("sse4.1");
+                const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+                if (avx2)
+                {
+                    return &sortAvx2;
+                }
+
+                if (sse41)
+                {
+                    return &sortSse41;
+                }
+            }
+#endif
+            return nullptr;
+        }
+
+        Kernel kernel_;
+
+    public:
+        SortingNetworkStrategy() : kernel_(selectKernel()) { }
+
+        void doAlgorithmInPlace(char* first, char* last) const override
+        {
+            const std::size_t size = static_cast<std::size_t>(last - first);
+
+            if (kernel_ == nullptr || size < kMinSize || size > kSize)
+            {
+                std::sort(first, last, std::less<>());
+                return;
+            }
+
+            // The padding sorts after every real character, so the first 'size' results are the sorted input.
+            char values[kSize];
+            std::fill(std::copy(first, last, values), values + kSize, static_cast<char>(CHAR_MAX));
+
+            kernel_(values);
+            std::copy(values, values + size, first);
+        }
+};
+
+// Often only the k smallest (or largest) characters are needed, and sorting the whole input is wasted work.
+// The result is just those k characters, in sorted order. Characters only have 256 possible values,
+// so the selection is a single counting pass over the input, which never branches on the data.
+class TopKStrategy : public Strategy
+{
+    private:
+        std::size_t k_;
+        bool largest_;
+
+    public:
+        explicit TopKStrategy(std::size_t k, bool largest = false) : k_(k), largest_(largest) { }
 
-int main()
+        std::size_t resultLength(std::size_t input_length) const override
+        {
+            return std::min(k_, input_length);
+        }
+
+        void doAlgorithmInPlace(char* first, char* last) const override
+        {
+            std::array<std::size_t, UCHAR_MAX + 1> counts{};
+
+            for (const char* c = first; c != last; ++c)
+            {
+                ++counts[static_cast<unsigned char>(*c)];
+            }
+
+            std::size_t remaining = resultLength(static_cast<std::size_t>(last - first));
+
+            for (int i = 0; i <= CHAR_MAX - CHAR_MIN && remaining > 0; ++i)
+            {
+                const char c = static_cast<char>(largest_ ? CHAR_MAX - i : CHAR_MIN + i);
+                const std::size_t count = std::min(remaining, counts[static_cast<unsigned char>(c)]);
+
+                first = std::fill_n(first, count, c);
+                remaining -= count;
+            }
+        }
+};
+
+// Sorts only the first k positions: they hold the k smallest characters in order, the rest follow in no particular order.
+class PartialSortStrategy : public Strategy
+{
+    private:
+        std::size_t k_;
+
+    public:
+        explicit PartialSortStrategy(std::size_t k) : k_(k) { }
+
+        void doAlgorithmInPlace(char* first, char* last) const override
+        {
+            std::partial_sort(first, first + std::min<std::size_t>(k_, last - first), last, std::less<>());
+        }
+};
+
+// Selection: puts the character that would be at position n after sorting there, with no larger
+// characters before it and no smaller ones after it. That is enough to get e.g. a median.
+class NthElementStrategy : public Strategy
 {
+    private:
+        std::size_t n_;
+
+    public:
+        explicit NthElementStrategy(std::size_t n) : n_(n) { }
+
+        void doAlgorithmInPlace(char* first, char* last) const override
+        {
+            if (n_ < static_cast<std::size_t>(last - first))
+            {
+                std::nth_element(first, first + n_, last, std::less<>());
+            }
+        }
+};
+
+// Top-k over an unbounded stream, where the input is never available as a whole.
+// It keeps the k best values seen so far in a heap whose top is the worst of them,
+// so every new value costs one comparison, plus O(log k) if it makes it into the top k.
+template <typename T, typename Compare = std::less<T>>
+class StreamingTopK
+{
+    private:
+        std::size_t k_;
+        Compare compare_;
+        std::vector<T> heap_;
+
+    public:
+        explicit StreamingTopK(std::size_t k, Compare compare = {}) : k_(k), compare_(compare)
+        {
+            heap_.reserve(k);
+        }
+
+        void push(const T& value)
+        {
+            if (heap_.size() < k_)
+            {
+                heap_.push_back(value);
+                std::push_heap(heap_.begin(), heap_.end(), compare_);
+            }
+            else if (k_ > 0 && compare_(value, heap_.front()))
+            {
+                std::pop_heap(heap_.begin(), heap_.end(), compare_);
+                heap_.back() = value;
+                std::push_heap(heap_.begin(), heap_.end(), compare_);
+            }
+        }
+
+        // The k best values so far, best first.
+        std::vector<T> sorted() const
+        {
+            std::vector<T> result(heap_);
+            std::sort_heap(result.begin(), result.end(), compare_);
+
+            return result;
+        }
+};
+
+// A strategy for inputs that do not fit in memory. In memory it simply delegates to its run strategy,
+// but it can also sort a whole file with bounded memory: the input is streamed in runs of run_size bytes,
+// every run is sorted by the run strategy (which may itself be parallel) and spilled to a temporary file,
+// and finally the runs are k-way merged into the output. The run strategy must sort in ascending order.
+// Memory use stays around 2 * run_size no matter how large the file is. A merge reads at most kMaxFanIn
+// runs at once, so with more runs than that they are merged in several passes, through longer runs.
+class ExternalSortStrategy : public Strategy
+{
+    public:
+        // Every run being merged holds an open file, so the fan-in is bounded by the process's file limit.
+        static constexpr std::size_t kMaxFanIn = 16;
+
+    private:
+        std::unique_ptr<Strategy> run_strategy_;
+        std::size_t run_size_;
+
+        // Streams one sorted run back from its temporary file through a fixed-size buffer.
+        class RunReader
+        {
+            private:
+                std::ifstream input_;
+                std::vector<char> buffer_;
+                std::size_t position_ = 0;
+                std::size_t end_ = 0;
+
+            public:
+                RunReader(const std::filesystem::path& path, std::size_t buffer_size) : input_(path, std::ios::binary), buffer_(buffer_size) { }
+
+                bool isOpen() const
+                {
+                    return input_.is_open();
+                }
+
+                // The unread part of the buffer, refilled from the file when it runs empty. False once the run is
+                // exhausted or cannot be read any further; failed() tells the two apart.
+                bool window(const char*& first, const char*& last)
+                {
+                    if (position_ == end_ && !failed())
+                    {
+                        input_.read(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+                        end_ = static_cast<std::size_t>(input_.gcount());
+                        position_ = 0;
+                    }
+
+                    first = buffer_.data() + position_;
+                    last = buffer_.data() + end_;
+
+                    return first != last;
+                }
+
+                // True after a read error, as opposed to the end of the run.
+                bool failed() const
+                {
+                    return input_.bad() || !input_.is_open();
+                }
+
+                void consume(std::size_t count)
+                {
+                    position_ += count;
+                }
+        };
+
+    public:
+        explicit ExternalSortStrategy(std::unique_ptr<Strategy>&& run_strategy = std::make_unique<ConcreteStrategyA>(), std::size_t run_size = 64 << 20)
+            : run_strategy_(std::move(run_strategy)), run_size_(std::max<std::size_t>(1, run_size)) { }
+
+        void doAlgorithmInPlace(char* first, char* last) const override
+        {
+            run_strategy_->doAlgorithmInPlace(first, last);
+        }
+
+        // Sorts the characters of the input file into the output file. Returns false if a file cannot be read or written.
+        bool sortFile(const std::string& input_path, const std::string& output_path) const
+        {
+            std::ifstream input(input_path, std::ios::binary);
+
+            if (!input)
+            {
+                return false;
+            }
+
+            // Phase 1: cut the input into sorted runs. I/O is double-buffered: the next run is
+            // read in the background while the current one is sorted and spilled.
+            std::array<std::vector<char>, 2> buffers{ std::vector<char>(run_size_), std::vector<char>(run_size_) };
+            std::vector<std::filesystem::path> runs;
+            bool ok = true;
+
+            auto readRun = [&input](std::vector<char>* buffer)
+            {
+                input.read(buffer->data(), static_cast<std::streamsize>(buffer->size()));
+                return static_cast<std::size_t>(input.gcount());
+            };
+
+            std::size_t current = 0;
+            std::size_t size = readRun(&buffers[current]);
+
+            while (ok && size > 0)
+            {
+                std::future<std::size_t> next = std::async(std::launch::async, readRun, &buffers[current ^ 1]);
+
+                char* run = buffers[current].data();
+                run_strategy_->doAlgorithmInPlace(run, run + size);
+
+                runs.push_back(temporaryRunPath(runs.size()));
+                std::ofstream output(runs.back(), std::ios::binary);
+                output.write(run, static_cast<std::streamsize>(size));
+
+                // Closing flushes, and a full disk may only show up then.
+                output.close();
+                ok = !output.fail();
+
+                size = next.get();
+                current ^= 1;
+            }
+
+            ok = ok && !input.bad();
+
+            // The run buffers are not needed anymore; the merge phase gets the memory instead.
+            buffers = {};
+
+            // Phase 2: merge groups of kMaxFanIn runs into longer runs until one merge can write the output.
+            // Each group's runs are deleted as soon as it is merged, so the disk holds about two copies of the data.
+            std::vector<std::filesystem::path> temporaries = runs;
+
+            while (ok && runs.size() > kMaxFanIn)
+            {
+                std::vector<std::filesystem::path> merged;
+
+                for (std::size_t i = 0; ok && i < runs.size(); i += kMaxFanIn)
+                {
+                    const std::vector<std::filesystem::path> group(runs.begin() + i, runs.begin() + std::min(i + kMaxFanIn, runs.size()));
+
+                    merged.push_back(temporaryRunPath(temporaries.size()));
+                    temporaries.push_back(merged.back());
+
+                    ok = mergeRuns(group, merged.back().string());
+                    removeRuns(group);
+                }
+
+                runs = std::move(merged);
+            }
+
+            if (ok)
+            {
+                ok = mergeRuns(runs, output_path);
+            }
+
+            removeRuns(temporaries);
+
+            return ok;
+        }
+
+    private:
+        std::filesystem::path temporaryRunPath(std::size_t index) const
+        {
+            const auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+
+            return std::filesystem::temp_directory_path() /
+                ("strategy-run-" + std::to_string(reinterpret_cast<std::uintptr_t>(this)) + "-" + std::to_string(now) + "-" + std::to_string(index) + ".tmp");
+        }
+
+        static void removeRuns(const std::vector<std::filesystem::path>& runs)
+        {
+            for (const std::filesystem::path& run : runs)
+            {
+                std::error_code ignored;
+                std::filesystem::remove(run, ignored);
+            }
+        }
+
+        // Merges at most kMaxFanIn runs into one sorted file. Returns false if a run cannot be opened or read,
+        // or the output cannot be written.
+        bool mergeRuns(const std::vector<std::filesystem::path>& runs, const std::string& output_path) const
+        {
+            std::ofstream output(output_path, std::ios::binary | std::ios::trunc);
+
+            if (!output)
+            {
+                return false;
+            }
+
+            // The memory budget is shared by one read buffer per run and two output buffers.
+            const std::size_t buffer_size = std::max<std::size_t>(4096, 2 * run_size_ / (runs.size() + 2));
+
+            // The heap holds the smallest unread character of every run that is not exhausted yet.
+            using Head = std::pair<char, std::size_t>;
+            std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+            std::vector<RunReader> readers;
+            readers.reserve(runs.size());
+
+            for (std::size_t i = 0; i < runs.size(); ++i)
+            {
+                readers.emplace_back(runs[i], buffer_size);
+
+                if (!readers[i].isOpen())
+                {
+                    return false;
+                }
+
+                const char* first;
+                const char* last;
+
+                if (readers[i].window(first, last))
+                {
+                    heads.push({ *first, i });
+                }
+            }
+
+            // The output is double-buffered too: one buffer is filled while the other one is written.
+            std::array<std::vector<char>, 2> buffers;
+            std::size_t current = 0;
+            std::future<bool> pending_write;
+            bool ok = true;
+
+            buffers[0].reserve(buffer_size);
+            buffers[1].reserve(buffer_size);
+
+            auto flush = [&]()
+            {
+                if (pending_write.valid())
+                {
+                    ok = pending_write.get() && ok;
+                }
+
+                pending_write = std::async(std::launch::async, [&output](const std::vector<char>* buffer)
+                {
+                    return static_cast<bool>(output.write(buffer->data(), static_cast<std::streamsize>(buffer->size())));
+                }, &buffers[current]);
+
+                current ^= 1;
+                buffers[current].clear();
+            };
+
+            while (!heads.empty())
+            {
+                const std::size_t run = heads.top().second;
+                heads.pop();
+
+                // Keep draining the same run for as long as it still holds the smallest characters.
+                // Since the run is sorted, they form a prefix of its buffer that can be copied in one go.
+                const char* first;
+                const char* last;
+
+                while (readers[run].window(first, last))
+                {
+                    const char* stop = heads.empty() ? last : std::upper_bound(first, last, heads.top().first);
+                    readers[run].consume(static_cast<std::size_t>(stop - first));
+
+                    while (first != stop)
+                    {
+                        const std::size_t count = std::min<std::size_t>(stop - first, buffer_size - buffers[current].size());
+                        buffers[current].insert(buffers[current].end(), first, first + count);
+                        first += count;
+
+                        if (buffers[current].size() == buffer_size)
+                        {
+                            flush();
+                        }
+                    }
+
+                    if (stop != last)
+                    {
+                        break;
+                    }
+                }
+
+                if (readers[run].window(first, last))
+                {
+                    heads.push({ *first, run });
+                }
+            }
+
+            flush();
+            ok = pending_write.get() && ok;
+
+            // A run that stopped early because of a read error would otherwise go unnoticed.
+            for (const RunReader& reader : readers)
+            {
+                ok = ok && !reader.failed();
+            }
+
+            output.close();
+
+            return ok && !output.fail();
+        }
+};
+
+// A Context that many threads can use at the same time while another thread swaps its strategy.
+// Up to kSlots concurrent readers never lock: before using the strategy they publish it in a hazard slot,
+// and a writer only deletes a replaced strategy once no slot refers to it anymore (deferred reclamation).
+// Readers beyond that limit do not spin for a slot; they take a shared lock instead, which only blocks while
+// a writer waits for them to finish with a replaced strategy. Writers are serialized and expected to be rare.
+class ConcurrentContext
+{
+    private:
+        static constexpr std::size_t kSlots = 64;
+
+        // A reader claims a free slot for the duration of one call and announces the strategy it uses in it.
+        struct alignas(64) Slot
+        {
+            std::atomic<bool> owned{ false };
+            std::atomic<Strategy*> hazard{ nullptr };
+        };
+
+        std::atomic<Strategy*> strategy_;
+        mutable std::array<Slot, kSlots> slots_;
+
+        std::mutex writer_mutex_;
+        std::vector<Strategy*> retired_;
+
+        // Held shared by the readers that found no free slot.
+        mutable std::shared_mutex overflow_mutex_;
+
+    public:
+        explicit ConcurrentContext(std::unique_ptr<Strategy>&& strategy = {}) : strategy_(strategy.release()) { }
+
+        ConcurrentContext(const ConcurrentContext&) = delete;
+        ConcurrentContext& operator=(const ConcurrentContext&) = delete;
+
+        // No reader may be inside the context anymore when it is destroyed.
+        ~ConcurrentContext()
+        {
+            delete strategy_.load();
+
+            for (Strategy* strategy : retired_)
+            {
+                delete strategy;
+            }
+        }
+
+        // Publishes the new strategy atomically. Readers that already picked up the old one
+        // finish with it; it is deleted by this or a later call once none of them uses it anymore.
+        void set_strategy(std::unique_ptr<Strategy>&& strategy)
+        {
+            std::lock_guard<std::mutex> lock(writer_mutex_);
+
+            // Free slots hold a null hazard too, so a null strategy would never look free; there is nothing to delete anyway.
+            if (Strategy* previous = strategy_.exchange(strategy.release()))
+            {
+                retired_.push_back(previous);
+            }
+
+            // Readers without a slot may still hold a replaced strategy until they release the shared lock.
+            // Those that take it from now on see the new strategy.
+            {
+                std::unique_lock<std::shared_mutex> drain(overflow_mutex_);
+            }
+
+            std::vector<Strategy*> in_use;
+            in_use.reserve(kSlots);
+
+            for (const Slot& slot : slots_)
+            {
+                in_use.push_back(slot.hazard.load());
+            }
+
+            auto is_free = [&in_use](Strategy* retired)
+            {
+                if (std::find(in_use.begin(), in_use.end(), retired) != in_use.end())
+                {
+                    return false;
+                }
+
+                delete retired;
+                return true;
+            };
+
+            retired_.erase(std::remove_if(retired_.begin(), retired_.end(), is_free), retired_.end());
+        }
+
+        void doSomeBusinessLogic(std::string_view text_to_sort) const
+        {
+            withStrategy([&](const Strategy* strategy)
+            {
+                if (strategy)
+                {
+                    std::cout << "ConcurrentContext: Sorting data using the strategy (not sure how it will do it)\n";
+                    std::cout << strategy->doAlgorithm(text_to_sort) << "\n";
+                }
+                else
+                {
+                    std::cout << "ConcurrentContext: Strategy isn't set\n";
+                }
+            });
+        }
+
+        void doSomeBusinessLogic(std::string_view text_to_sort, std::string& result) const
+        {
+            withStrategy([&](const Strategy* strategy)
+            {
+                if (strategy)
+                {
+                    strategy->doAlgorithm(text_to_sort, result);
+                }
+                else
+                {
+                    result.assign(text_to_sort.data(), text_to_sort.size());
+                }
+            });
+        }
+
+    private:
+        template <typename Fn>
+        void withStrategy(Fn fn) const
+        {
+            Slot* claimed = claimSlot();
+
+            if (claimed == nullptr)
+            {
+                std::shared_lock<std::shared_mutex> lock(overflow_mutex_);
+                fn(static_cast<const Strategy*>(strategy_.load()));
+
+                return;
+            }
+
+            Slot& slot = *claimed;
+
+            // Announce the strategy, then make sure it was not replaced in the meantime: once the hazard
+            // is visible and the strategy is still current, a writer can no longer delete it.
+            Strategy* strategy = strategy_.load();
+            Strategy* current;
+
+            do
+            {
+                current = strategy;
+                slot.hazard.store(current);
+                strategy = strategy_.load();
+            }
+            while (strategy != current);
+
+            fn(static_cast<const Strategy*>(strategy));
+
+            slot.hazard.store(nullptr, std::memory_order_release);
+            slot.owned.store(false, std::memory_order_release);
+        }
+
+        // Every thread starts looking at its own slot, so in the common case the first attempt succeeds.
+        // Returns null, after one pass over all slots, if every slot is taken.
+        Slot* claimSlot() const
+        {
+            static thread_local const std::size_t home = std::hash<std::thread::id>()(std::this_thread::get_id()) % kSlots;
+
+            for (std::size_t n = 0; n < kSlots; ++n)
+            {
+                const std::size_t i = (home + n) % kSlots;
+                bool expected = false;
+
+                if (!slots_[i].owned.load(std::memory_order_relaxed) && slots_[i].owned.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                {
+                    return &slots_[i];
+                }
+            }
+
+            return nullptr;
+        }
+};
+
+// A self-tuning variant of the Context. Instead of relying on the client to pick the right strategy,
+// it keeps a pool of equivalent strategies (they must all produce the same result) and learns which
+// one is the fastest for the data it actually sees.
+// Inputs are bucketed by size (one bucket per power of two), and every bucket runs a small
+// epsilon-greedy bandit: each strategy is first sampled a few times, after that the fastest one is
+// exploited and, with a small probability, another one is explored so the choice can follow drifting inputs.
+class AdaptiveContext
+{
+    private:
+        struct Arm
+        {
+            double mean_ns = 0.0;
+            std::size_t samples = 0;
+            std::size_t picks = 0;
+        };
+
+        std::vector<std::unique_ptr<Strategy>> strategies_;
+
+        // One row of arms per size bucket, one arm per strategy.
+        std::array<std::vector<Arm>, 65> buckets_;
+
+        std::size_t warmup_samples_;
+        double exploration_rate_;
+        std::mt19937 random_;
+
+    public:
+        explicit AdaptiveContext(std::size_t warmup_samples = 3, double exploration_rate = 0.05)
+            : warmup_samples_(std::max<std::size_t>(1, warmup_samples)), exploration_rate_(exploration_rate) { }
+
+        // Adds another candidate to the pool. It must produce the same result as the ones already in it.
+        void add_strategy(std::unique_ptr<Strategy>&& strategy)
+        {
+            strategies_.push_back(std::move(strategy));
+
+            for (std::vector<Arm>& arms : buckets_)
+            {
+                arms.emplace_back();
+            }
+        }
+
+        // Sorts the data in place with the strategy the bandit picks and feeds the measured runtime back into it.
+        // Returns the index of the strategy that ran; there must be at least one.
+        std::size_t sortInPlace(char* first, char* last)
+        {
+            if (strategies_.empty())
+            {
+                return 0;
+            }
+
+            std::vector<Arm>& arms = buckets_[bucketOf(static_cast<std::size_t>(last - first))];
+            const std::size_t chosen = choose(arms);
+
+            const auto start = std::chrono::steady_clock::now();
+            strategies_[chosen]->doAlgorithmInPlace(first, last);
+            const auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+            // Plain average while warming up, then an exponential moving average so old samples fade out.
+            Arm& arm = arms[chosen];
+            ++arm.picks;
+            ++arm.samples;
+            const double weight = (arm.samples <= warmup_samples_) ? 1.0 / arm.samples : 0.1;
+            arm.mean_ns += (elapsed - arm.mean_ns) * weight;
+
+            return chosen;
+        }
+
+        std::string sort(std::string_view data)
+        {
+            std::string result;
+            sort(data, result);
+
+            return result;
+        }
+
+        std::size_t sort(std::string_view data, std::string& result)
+        {
+            result.assign(data.data(), data.size());
+            const std::size_t chosen = sortInPlace(result.data(), result.data() + result.size());
+
+            if (!strategies_.empty())
+            {
+                result.resize(strategies_[chosen]->resultLength(data.size()));
+            }
+
+            return chosen;
+        }
+
+        void doSomeBusinessLogic(std::string_view text_to_sort)
+        {
+            if (strategies_.empty())
+            {
+                std::cout << "AdaptiveContext: No strategies to choose from\n";
+                return;
+            }
+
+            std::string result;
+            const std::size_t chosen = sort(text_to_sort, result);
+
+            std::cout << "AdaptiveContext: Sorted data using strategy #" << chosen
+                      << (chosen == bestFor(text_to_sort.size()) ? " (the fastest so far for this size)\n" : " (exploring)\n");
+            std::cout << result << "\n";
+        }
+
+        // The strategy the context currently considers the fastest for inputs of the given size.
+        std::size_t bestFor(std::size_t size) const
+        {
+            const std::vector<Arm>& arms = buckets_[bucketOf(size)];
+            return fastest(arms);
+        }
+
+        // Exposes the decisions made so far: per size bucket, how often each strategy was picked and how fast it was.
+        void report(std::ostream& os) const
+        {
+            for (std::size_t bucket = 0; bucket < buckets_.size(); ++bucket)
+            {
+                const std::vector<Arm>& arms = buckets_[bucket];
+
+                if (std::none_of(arms.begin(), arms.end(), [](const Arm& arm) { return arm.picks > 0; }))
+                {
+                    continue;
+                }
+
+                os << "AdaptiveContext: sizes below " << (bucket < 64 ? std::to_string(std::size_t{ 1 } << bucket) : std::string("2^64"))
+                   << " -> strategy #" << fastest(arms) << "\n";
+
+                for (std::size_t i = 0; i < arms.size(); ++i)
+                {
+                    os << "    strategy #" << i << ": " << arms[i].picks << " picks, " << arms[i].mean_ns << " ns on average\n";
+                }
+            }
+        }
+
+    private:
+        // Bucket b holds the sizes that need exactly b bits, i.e. [2^(b-1), 2^b).
+        static std::size_t bucketOf(std::size_t size)
+        {
+            std::size_t bits = 0;
+
+            while (size != 0)
+            {
+                ++bits;
+                size >>= 1;
+            }
+
+            return bits;
+        }
+
+        static std::size_t fastest(const std::vector<Arm>& arms)
+        {
+            std::size_t best = 0;
+
+            for (std::size_t i = 1; i < arms.size(); ++i)
+            {
+                if (arms[i].samples > 0 && (arms[best].samples == 0 || arms[i].mean_ns < arms[best].mean_ns))
+                {
+                    best = i;
+                }
+            }
+
+            return best;
+        }
+
+        std::size_t choose(const std::vector<Arm>& arms)
+        {
+            // Explore: every strategy gets its warm-up samples first.
+            for (std::size_t i = 0; i < arms.size(); ++i)
+            {
+                if (arms[i].samples < warmup_samples_)
+                {
+                    return i;
+                }
+            }
+
+            // Then mostly exploit, but keep exploring now and then.
+            if (std::uniform_real_distribution<double>(0.0, 1.0)(random_) < exploration_rate_)
+            {
+                return std::uniform_int_distribution<std::size_t>(0, arms.size() - 1)(random_);
+            }
+
+            return fastest(arms);
+        }
+};
+
+// The same Context/Strategy shape works for records sorted by a key, e.g. fixed-size structs.
+// Every strategy is parameterized with a key extractor: a function object that returns the key of a record.
+template <typename Record>
+class RecordStrategy
+{
+    public:
+        virtual ~RecordStrategy() = default;
+        virtual void doAlgorithm(Record* first, Record* last) const = 0;
+};
+
+template <typename Record>
+class RecordContext
+{
+    private:
+        std::unique_ptr<RecordStrategy<Record>> strategy_;
+
+    public:
+        explicit RecordContext(std::unique_ptr<RecordStrategy<Record>>&& strategy = {}) : strategy_(std::move(strategy)) { }
+
+        void set_strategy(std::unique_ptr<RecordStrategy<Record>>&& strategy)
+        {
+            strategy_ = std::move(strategy);
+        }
+
+        void doSomeBusinessLogic(std::vector<Record>& records) const
+        {
+            if (strategy_)
+            {
+                std::cout << "RecordContext: Sorting " << records.size() << " records using the strategy (not sure how it will do it)\n";
+                strategy_->doAlgorithm(records.data(), records.data() + records.size());
+            }
+            else
+            {
+                std::cout << "RecordContext: Strategy isn't set\n";
+            }
+        }
+};
+
+// Splits the keys the radix strategy supports into byte-sized digits, least significant digit first.
+// Signed integers get their sign bit flipped, so negative keys sort first. Fixed-width strings are
+// std::array<unsigned char, N> and sort like memcmp, which is also how std::less compares them.
+template <typename Key, typename = void>
+struct RadixKey;
+
+template <typename Key>
+struct RadixKey<Key, std::enable_if_t<std::is_integral_v<Key>>>
+{
+    static constexpr std::size_t kDigits = sizeof(Key);
+
+    static unsigned char digit(Key key, std::size_t d)
+    {
+        using Unsigned = std::make_unsigned_t<Key>;
+        Unsigned bits = static_cast<Unsigned>(key);
+
+        if constexpr (std::is_signed_v<Key>)
+        {
+            bits ^= Unsigned{ 1 } << (sizeof(Key) * CHAR_BIT - 1);
+        }
+
+        return static_cast<unsigned char>(bits >> (CHAR_BIT * d));
+    }
+};
+
+template <std::size_t N>
+struct RadixKey<std::array<unsigned char, N>>
+{
+    static constexpr std::size_t kDigits = N;
+
+    static unsigned char digit(const std::array<unsigned char, N>& key, std::size_t d)
+    {
+        return key[N - 1 - d];
+    }
+};
+
+// A comparison sort on the extracted keys. Works for any key with operator<, but is not stable.
+template <typename Record, typename KeyOf>
+class ComparisonRecordStrategy : public RecordStrategy<Record>
+{
+    private:
+        KeyOf key_of_;
+
+    public:
+        explicit ComparisonRecordStrategy(KeyOf key_of = {}) : key_of_(key_of) { }
+
+        void doAlgorithm(Record* first, Record* last) const override
+        {
+            std::sort(first, last, [this](const Record& a, const Record& b) { return key_of_(a) < key_of_(b); });
+        }
+};
+
+// An LSD radix sort: one stable counting pass per key byte, least significant byte first.
+// The histograms of all bytes are built in a single pass up front, and passes in which all
+// records share the same byte are skipped. It needs a scratch copy of the records and it is stable.
+template <typename Record, typename KeyOf>
+class RadixRecordStrategy : public RecordStrategy<Record>
+{
+    private:
+        KeyOf key_of_;
+
+    public:
+        explicit RadixRecordStrategy(KeyOf key_of = {}) : key_of_(key_of) { }
+
+        void doAlgorithm(Record* first, Record* last) const override
+        {
+            using Key = std::decay_t<decltype(key_of_(*first))>;
+            using Digits = RadixKey<Key>;
+
+            const std::size_t size = static_cast<std::size_t>(last - first);
+
+            if (size < 2)
+            {
+                return;
+            }
+
+            std::vector<std::array<std::size_t, UCHAR_MAX + 1>> counts(Digits::kDigits);
+
+            for (const Record* record = first; record != last; ++record)
+            {
+                const Key key = key_of_(*record);
+
+                for (std::size_t d = 0; d < Digits::kDigits; ++d)
+                {
+                    ++counts[d][Digits::digit(key, d)];
+                }
+            }
+
+            std::vector<Record> scratch(first, last);
+            Record* from = first;
+            Record* to = scratch.data();
+
+            for (std::size_t d = 0; d < Digits::kDigits; ++d)
+            {
+                if (std::find(counts[d].begin(), counts[d].end(), size) != counts[d].end())
+                {
+                    continue;
+                }
+
+                // A local copy of the offsets: the compiler cannot tell that the record stores
+                // below do not overwrite them, and would reload them on every record otherwise.
+                std::array<std::size_t, UCHAR_MAX + 1> offsets;
+                std::size_t offset = 0;
+
+                for (std::size_t bucket = 0; bucket <= UCHAR_MAX; ++bucket)
+                {
+                    offsets[bucket] = offset;
+                    offset += counts[d][bucket];
+                }
+
+                for (const Record* record = from; record != from + size; ++record)
+                {
+                    to[offsets[Digits::digit(key_of_(*record), d)]++] = *record;
+                }
+
+                std::swap(from, to);
+            }
+
+            if (from != first)
+            {
+                std::copy(from, from + size, first);
+            }
+        }
+};
+
+// Sorts slices of the records on separate threads with another record strategy, then merges
+// neighbouring slices pairwise (also in parallel) until one sorted range is left.
+// Below the threshold it just runs the slice strategy on the calling thread.
+template <typename Record, typename KeyOf>
+class ParallelRecordStrategy : public RecordStrategy<Record>
+{
+    private:
+        std::unique_ptr<RecordStrategy<Record>> slice_strategy_;
+        KeyOf key_of_;
+        unsigned threads_;
+        std::size_t sequential_threshold_;
+
+    public:
+        explicit ParallelRecordStrategy(std::unique_ptr<RecordStrategy<Record>>&& slice_strategy, KeyOf key_of = {},
+            unsigned threads = std::thread::hardware_concurrency(), std::size_t sequential_threshold = 1 << 16)
+            : slice_strategy_(std::move(slice_strategy)), key_of_(key_of), threads_(std::max(1u, threads)), sequential_threshold_(sequential_threshold) { }
+
+        void doAlgorithm(Record* first, Record* last) const override
+        {
+            const std::size_t size = static_cast<std::size_t>(last - first);
+            const std::size_t slices = std::min<std::size_t>(threads_, size / std::max<std::size_t>(1, sequential_threshold_));
+
+            if (slices <= 1)
+            {
+                slice_strategy_->doAlgorithm(first, last);
+                return;
+            }
+
+            std::vector<std::size_t> bounds(slices + 1);
+
+            for (std::size_t i = 0; i <= slices; ++i)
+            {
+                bounds[i] = size * i / slices;
+            }
+
+            runInParallel(static_cast<unsigned>(slices), [&](unsigned t)
+            {
+                slice_strategy_->doAlgorithm(first + bounds[t], first + bounds[t + 1]);
+            });
+
+            const auto less = [this](const Record& a, const Record& b) { return key_of_(a) < key_of_(b); };
+
+            for (std::size_t width = 1; width < slices; width *= 2)
+            {
+                const std::size_t merges = (slices + 2 * width - 1) / (2 * width);
+
+                runInParallel(static_cast<unsigned>(merges), [&](unsigned m)
+                {
+                    const std::size_t left = 2 * width * m;
+                    const std::size_t middle = std::min(slices, left + width);
+                    const std::size_t right = std::min(slices, left + 2 * width);
+
+                    std::inplace_merge(first + bounds[left], first + bounds[middle], first + bounds[right], less);
+                });
+            }
+        }
+};
+
+// The client code picks a concrete strategy and passes it to the context. 
+// The client should be aware of the differences between strategies in order to make the right choice.
+void clientCode()
+{
+    // std::string text_to_sort("haegicbjdf");
+    std::string text_to_sort{"haegicbjdf"};
+    //std::string_view text_to_sort{"haegicbjdf"};
+
+    // The Client creates a specific strategy object and passes it to the context. 
+    Context context(std::make_unique<ConcreteStrategyA>());
+
+    std::cout << "Client: Strategy is set to sort in ascending order.\n";
+    context.doSomeBusinessLogic(text_to_sort);
+
+    std::cout << "\n";
+
+    // The context exposes a setter which lets the Client replace 
+    // the strategy object associated with the context at runtime.
+    context.set_strategy(std::make_unique<ConcreteStrategyB>());
+
+    std::cout << "Client: Strategy is set to sort in descending order.\n";
+    context.doSomeBusinessLogic(text_to_sort);
+
+    std::cout << "\n";
+
+    // Large inputs can be sorted on all cores. Short ones, like this one, fall back to a sequential sort.
+    context.set_strategy(std::make_unique<ParallelStrategy>());
+
+    std::cout << "Client: Strategy is set to sort in ascending order on all cores.\n";
+    context.doSomeBusinessLogic(text_to_sort);
+
+    std::cout << "\n";
+
+    // The adaptive context does not need the client to choose at all. It only needs
+    // a pool of strategies that produce the same result and it learns which one is faster.
+    AdaptiveContext adaptive_context;
+    adaptive_context.add_strategy(std::make_unique<ConcreteStrategyA>());
+    adaptive_context.add_strategy(std::make_unique<ParallelStrategy>(std::thread::hardware_concurrency(), 0));
+
+    std::mt19937 random;
+
+    for (std::size_t size : { 16, 1 << 20, 16, 1 << 20, 16, 1 << 20, 16, 1 << 20 })
+    {
+        std::string data(size, '\0');
+        std::generate(data.begin(), data.end(), [&random]() { return static_cast<char>('a' + random() % 26); });
+        adaptive_context.sort(data);
+    }
+
+    std::cout << "Client: Strategy is picked by the context.\n";
+    adaptive_context.doSomeBusinessLogic(text_to_sort);
+    adaptive_context.report(std::cout);
+
+    std::cout << "\n";
+
+    // Hot loops can hand in their own buffer (or sort their data in place), so once
+    // the buffer has grown to the input size no call allocates anymore.
+    context.set_strategy(std::make_unique<ConcreteStrategyA>());
+
+    std::string result;
+
+    for (std::string_view word : { "delta", "alpha", "charlie", "bravo" })
+    {
+        context.doSomeBusinessLogic(word, result);
+        std::cout << "Client: Sorted \"" << word << "\" into a reused buffer: " << result << "\n";
+    }
+
+    context.doSomeBusinessLogicInPlace(text_to_sort);
+    std::cout << "Client: Sorted the text in place: " << text_to_sort << "\n";
+
+    std::cout << "\n";
+
+    // When the strategy never changes, the client can fix it at compile time.
+    StaticContext<DescendingOrder> static_context;
+
+    std::cout << "Client: Strategy is fixed at compile time to sort in descending order.\n";
+    static_context.doSomeBusinessLogic(text_to_sort);
+
+    std::cout << "\n";
+
+    // Files larger than memory are sorted in runs that are merged afterwards.
+    // The tiny run size here forces several runs even for this short text.
+    const std::filesystem::path input_path = std::filesystem::temp_directory_path() / "strategy-input.txt";
+    const std::filesystem::path output_path = std::filesystem::temp_directory_path() / "strategy-output.txt";
+
+    std::ofstream(input_path, std::ios::binary) << "haegicbjdf";
+
+    ExternalSortStrategy external_strategy(std::make_unique<ParallelStrategy>(), 4);
+
+    std::cout << "Client: Sorting a file in runs of 4 bytes.\n";
+
+    if (external_strategy.sortFile(input_path.string(), output_path.string()))
+    {
+        std::ifstream output(output_path, std::ios::binary);
+        std::cout << output.rdbuf() << "\n";
+    }
+
+    std::filesystem::remove(input_path);
+    std::filesystem::remove(output_path);
+
+    std::cout << "\n";
+
+    // Short inputs can go through a branch-free sorting network instead.
+    context.set_strategy(std::make_unique<SortingNetworkStrategy>());
+
+    std::cout << "Client: Strategy is set to sort short texts with a sorting network.\n";
+    context.doSomeBusinessLogic("haegicbjdf");
+
+    std::cout << "\n";
+
+    // Lots of tiny strings are cheaper to sort as one packed batch than one call at a time.
+    PackedStrings batch;
+
+    for (std::string_view word : { "delta", "alpha", "charlie", "bravo" })
+    {
+        batch.push_back(word);
+    }
+
+    context.set_strategy(std::make_unique<ConcreteStrategyB>());
+    context.doSomeBusinessLogicBatch(batch);
+
+    std::cout << "Client: Sorted a batch of " << batch.size() << " strings in descending order:";
+
+    for (std::size_t i = 0; i < batch.size(); ++i)
+    {
+        std::cout << " " << batch[i];
+    }
+
+    std::cout << "\n\n";
+
+    // Records are sorted through the same pattern; the client only has to say what the key is.
+    struct Order
+    {
+        std::uint64_t id;
+        std::int32_t quantity;
+        std::array<unsigned char, 4> desk;
+    };
+
+    struct ByQuantity
+    {
+        std::int32_t operator()(const Order& order) const
+        {
+            return order.quantity;
+        }
+    };
+
+    struct ByDesk
+    {
+        std::array<unsigned char, 4> operator()(const Order& order) const
+        {
+            return order.desk;
+        }
+    };
+
+    std::vector<Order> orders{ { 1, 300, { 'L', 'D', 'N', ' ' } }, { 2, -50, { 'N', 'Y', 'C', ' ' } }, { 3, 120, { 'H', 'K', 'G', ' ' } }, { 4, 75, { 'L', 'D', 'N', ' ' } } };
+
+    auto printOrders = [&orders]()
+    {
+        for (const Order& order : orders)
+        {
+            std::cout << "    #" << order.id << " " << order.quantity << " " << std::string(order.desk.begin(), order.desk.end()) << "\n";
+        }
+    };
+
+    RecordContext<Order> record_context(std::make_unique<RadixRecordStrategy<Order, ByQuantity>>());
+
+    std::cout << "Client: Strategy is set to a radix sort by quantity.\n";
+    record_context.doSomeBusinessLogic(orders);
+    printOrders();
+
+    record_context.set_strategy(std::make_unique<ParallelRecordStrategy<Order, ByDesk>>(std::make_unique<ComparisonRecordStrategy<Order, ByDesk>>()));
+
+    std::cout << "Client: Strategy is set to a parallel comparison sort by desk.\n";
+    record_context.doSomeBusinessLogic(orders);
+    printOrders();
+
+    std::cout << "\n";
+
+    // A concurrent context can be shared by many threads while its strategy is swapped live.
+    ConcurrentContext concurrent_context(std::make_unique<ConcreteStrategyA>());
+    std::atomic<bool> stop{ false };
+    std::vector<std::thread> readers;
+
+    for (int i = 0; i < 3; ++i)
+    {
+        readers.emplace_back([&]()
+        {
+            std::string sorted;
+
+            while (!stop.load())
+            {
+                concurrent_context.doSomeBusinessLogic("haegicbjdf", sorted);
+            }
+        });
+    }
+
+    for (int swap = 0; swap < 100; ++swap)
+    {
+        if (swap % 2 == 0)
+        {
+            concurrent_context.set_strategy(std::make_unique<ConcreteStrategyB>());
+        }
+        else
+        {
+            concurrent_context.set_strategy(std::make_unique<ConcreteStrategyA>());
+        }
+
+        std::this_thread::yield();
+    }
+
+    stop = true;
+
+    for (std::thread& reader : readers)
+    {
+        reader.join();
+    }
+
+    std::cout << "Client: " << readers.size() << " threads kept sorting while the strategy was swapped 100 times.\n";
+    concurrent_context.doSomeBusinessLogic("haegicbjdf");
+
+    std::cout << "\n";
+
+    // When only part of the order matters, the strategy can do less work.
+    context.set_strategy(std::make_unique<TopKStrategy>(3));
+
+    std::cout << "Client: Strategy is set to the 3 smallest characters.\n";
+    context.doSomeBusinessLogic("haegicbjdf");
+
+    context.set_strategy(std::make_unique<NthElementStrategy>(5));
+
+    std::cout << "Client: Strategy is set to put the median in place.\n";
+    context.doSomeBusinessLogic("haegicbjdf");
+
+    StreamingTopK<char, std::greater<>> largest(3);
+
+    for (char c : std::string_view("haegicbjdf"))
+    {
+        largest.push(c);
+    }
+
+    const std::vector<char> top = largest.sorted();
+    std::cout << "Client: The 3 largest characters of the stream are " << std::string(top.begin(), top.end()) << "\n";
+
+    std::cout << "\n";
+
+    // Results that live exactly as long as a request can come from an arena that is released in one go.
+    {
+        std::array<std::byte, 1024> request_memory;
+        std::pmr::monotonic_buffer_resource arena(request_memory.data(), request_memory.size());
+        std::pmr::vector<std::pmr::string> results(&arena);
+
+        context.set_strategy(std::make_unique<ConcreteStrategyA>());
+
+        for (std::string_view word : { "delta", "alpha", "charlie", "bravo" })
+        {
+            results.push_back(context.doSomeBusinessLogic(word, &arena));
+        }
+
+        std::cout << "Client: Sorted " << results.size() << " words into a request arena:";
+
+        for (const std::pmr::string& sorted_word : results)
+        {
+            std::cout << " " << sorted_word;
+        }
+
+        std::cout << "\n";
+    }
+}
+
+// Counts heap allocations for the benchmark. Replacing the global operator new is the only portable way to see them.
+// Only allocations made while the benchmark runs are counted; the rest of the program just pays for one load.
+std::atomic<bool> counting_allocations{ false };
+std::atomic<std::size_t> allocation_count{ 0 };
+
+STRATEGY_NOINLINE void* operator new(std::size_t size)
+{
+    if (counting_allocations.load(std::memory_order_relaxed))
+    {
+        allocation_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (void* memory = std::malloc(size > 0 ? size : 1))
+    {
+        return memory;
+    }
+
+    throw std::bad_alloc();
+}
+
+STRATEGY_NOINLINE void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+STRATEGY_NOINLINE void operator delete(void* memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+// A strategy the benchmark compares. Strategies that do less than a full sort (top-k, partial sort, selection)
+// are reported in a table of their own, as their times do not compare with those of full sorts.
+struct RegisteredStrategy
+{
+    std::string name;
+    std::unique_ptr<Strategy> strategy;
+    bool full_sort;
+};
+
+// Every strategy the benchmark compares. A new strategy only has to be added here to show up in the results.
+std::vector<RegisteredStrategy> registeredStrategies()
+{
+    std::vector<RegisteredStrategy> strategies;
+
+    strategies.push_back({ "ConcreteStrategyA", std::make_unique<ConcreteStrategyA>(), true });
+    strategies.push_back({ "ConcreteStrategyB", std::make_unique<ConcreteStrategyB>(), true });
+    strategies.push_back({ "ParallelStrategy", std::make_unique<ParallelStrategy>(), true });
+    strategies.push_back({ "SortingNetworkStrategy", std::make_unique<SortingNetworkStrategy>(), true });
+    strategies.push_back({ "TopKStrategy(16)", std::make_unique<TopKStrategy>(16), false });
+    strategies.push_back({ "PartialSortStrategy(16)", std::make_unique<PartialSortStrategy>(16), false });
+    strategies.push_back({ "NthElementStrategy(8)", std::make_unique<NthElementStrategy>(8), false });
+
+    return strategies;
+}
+
+// Generates benchmark inputs of printable characters with different amounts of existing order.
+std::string benchmarkInput(std::string_view distribution, std::size_t size)
+{
+    std::mt19937 random(static_cast<std::mt19937::result_type>(size));
+    std::string data(size, '\0');
+
+    if (distribution == "few-unique")
+    {
+        std::generate(data.begin(), data.end(), [&random]() { return "acgt"[random() % 4]; });
+    }
+    else if (distribution == "skewed")
+    {
+        // Roughly Zipf-like: every letter is about half as likely as the one before it.
+        std::geometric_distribution<int> letter(0.5);
+        std::generate(data.begin(), data.end(), [&]() { return static_cast<char>('a' + std::min(letter(random), 25)); });
+    }
+    else
+    {
+        std::generate(data.begin(), data.end(), [&random]() { return static_cast<char>(' ' + random() % 95); });
+
+        if (distribution == "sorted")
+        {
+            std::sort(data.begin(), data.end());
+        }
+        else if (distribution == "reverse")
+        {
+            std::sort(data.begin(), data.end(), std::greater<>());
+        }
+    }
+
+    return data;
+}
+
+// Runs every registered strategy over a grid of input sizes and distributions and writes one row per
+// combination as CSV or JSON: nanoseconds per byte, heap allocations per call and CPU cycles per byte
+// (from the time-stamp counter, so only on x86, and 0 elsewhere). Calls reuse the result buffer, so
+// the allocations are the strategy's own. The full sorts come first, then, as a separate table (a second
+// CSV block, or a second JSON array), the strategies that only partially sort.
+void benchmarkStrategies(std::ostream& os, bool json)
+{
+    const std::array<std::string_view, 5> distributions{ "random", "sorted", "reverse", "few-unique", "skewed" };
+
+    // The short lengths are where the sorting network competes; the long ones are where the parallel strategy does.
+    const std::array<std::size_t, 14> sizes{ 1, 2, 4, 8, 12, 16, 24, 32, 48, 64, 1 << 10, 1 << 14, 1 << 17, 1 << 20 };
+
+    // About this many bytes are sorted per measurement, so small inputs are repeated more often.
+    constexpr std::size_t kBytesPerMeasurement = std::size_t{ 1 } << 24;
+
+    auto readCycles = []() -> std::uint64_t
+    {
+#if STRATEGY_X86
+        return __rdtsc();
+#else
+        return 0;
+#endif
+    };
+
+    const std::vector<RegisteredStrategy> strategies = registeredStrategies();
+    counting_allocations.store(true);
+
+    os << (json ? "{\n" : "");
+
+    for (const bool full_sorts : { true, false })
+    {
+        bool first_row = true;
+
+        if (json)
+        {
+            os << (full_sorts ? "\"full_sorts\": [\n" : ",\n\"partial\": [\n");
+        }
+        else
+        {
+            os << (full_sorts ? "" : "\n") << "strategy,distribution,size,ns_per_byte,allocations_per_call,cycles_per_byte\n";
+        }
+
+        for (const RegisteredStrategy& registered : strategies)
+        {
+            if (registered.full_sort != full_sorts)
+            {
+                continue;
+            }
+
+            const std::string& name = registered.name;
+            const Strategy* strategy = registered.strategy.get();
+
+            for (std::string_view distribution : distributions)
+            {
+                for (std::size_t size : sizes)
+                {
+                    const std::string data = benchmarkInput(distribution, size);
+                    const std::size_t calls = std::max<std::size_t>(1, kBytesPerMeasurement / size);
+
+                    std::string result;
+                    strategy->doAlgorithm(data, result);
+
+                    const std::size_t allocations = allocation_count.load();
+                    const std::uint64_t cycles = readCycles();
+                    const auto start = std::chrono::steady_clock::now();
+
+                    for (std::size_t call = 0; call < calls; ++call)
+                    {
+                        strategy->doAlgorithm(data, result);
+                    }
+
+                    const double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+                    const double bytes = static_cast<double>(calls) * static_cast<double>(size);
+                    const double cycles_per_byte = static_cast<double>(readCycles() - cycles) / bytes;
+                    const double allocations_per_call = static_cast<double>(allocation_count.load() - allocations) / static_cast<double>(calls);
+
+                    if (json)
+                    {
+                        os << (first_row ? "" : ",\n") << "  { \"strategy\": \"" << name << "\", \"distribution\": \"" << distribution
+                           << "\", \"size\": " << size << ", \"ns_per_byte\": " << ns / bytes
+                           << ", \"allocations_per_call\": " << allocations_per_call << ", \"cycles_per_byte\": " << cycles_per_byte << " }";
+                    }
+                    else
+                    {
+                        os << name << "," << distribution << "," << size << "," << ns / bytes << "," << allocations_per_call << "," << cycles_per_byte << "\n";
+                    }
+
+                    first_row = false;
+                }
+            }
+        }
+
+        if (json)
+        {
+            os << "\n]";
+        }
+    }
+
+    counting_allocations.store(false);
+    os << (json ? "\n}\n" : "");
+}
+
+// Run with --benchmark (CSV) or --benchmark json to compare the strategies instead of running the example.
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && std::strcmp(argv[1], "--benchmark") == 0)
+    {
+        benchmarkStrategies(std::cout, argc > 2 && std::strcmp(argv[2], "json") == 0);
+        return 0;
+    }
+
     clientCode();
     return 0;
 }
\ No newline at end of file